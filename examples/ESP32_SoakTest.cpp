@@ -0,0 +1,146 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	Example: Long uptime soak test using a virtual clock and a local mock server
+
+	Runs against ESP32_SoakTest_MockServer.py instead of Azure AD and Microsoft Graph, which
+	answers the login flow, token refresh, presence, events and setPresence and injects errors.
+	The library clock starts shortly before the 32 bit millis() wrap (~49.7 days) and runs
+	TIME_FACTOR times faster than real time, so one virtual week passes in about 3 real minutes.
+	Heap usage, cache statistics and token lifetime are checked and reported in every cycle.
+	Keep-alive is enabled, the mock server logs requests and connections, so reuse can be checked.
+
+	Start the mock server on a PC in the same network:
+		python3 ESP32_SoakTest_MockServer.py --port 8080 --error-rate 0.05
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include <Arduino.h>
+#include <ArduinoMSGraph.h>
+#include <WiFiClientSecure.h>
+
+#include "credentials.h"
+
+#define MOCK_SERVER "http://192.168.1.10:8080"			// Address of ESP32_SoakTest_MockServer.py
+#define TIME_FACTOR 3600								// 1 real second = 1 virtual hour
+#define CLOCK_START (0xFFFFFFFFUL - 10UL * 60 * 1000)	// 10 virtual minutes before wrap
+#define CYCLE_DELAY 1000								// Real ms between cycles
+
+WiFiClientSecure client;
+ArduinoMSGraph graphClient(client, tenant, clientId);
+
+DynamicJsonDocument deviceCodeDoc(JSON_OBJECT_SIZE(6) + 540);
+DynamicJsonDocument pollingDoc(10000);
+
+enum STATES {
+	no_context,
+	context_available,
+	token_needs_refresh
+};
+STATES currentState = no_context;
+
+unsigned long cycle = 0;
+unsigned long refreshCount = 0;
+unsigned long requestErrors = 0;
+unsigned long timingErrors = 0;
+uint32_t startFreeHeap = 0;
+uint32_t startMaxAlloc = 0;
+
+unsigned long virtualClock() {
+	return CLOCK_START + millis() * TIME_FACTOR;
+}
+
+// A fresh token must be valid for at most a few hours, no matter where the clock is
+void checkLifetimeAfterToken() {
+	int lifetime = graphClient.getTokenLifetime();
+	if (lifetime <= 0 || lifetime > 24 * 3600) {
+		timingErrors++;
+		Serial.printf("TIMING ERROR: Lifetime after token: %d s\n", lifetime);
+	}
+}
+
+void setup()
+{
+	Serial.begin(115200);
+
+	WiFi.mode(WIFI_STA);
+	WiFi.begin(ssid, password);
+	while (WiFi.status() != WL_CONNECTED)
+	{
+		delay(500);
+		Serial.print(".");
+	}
+	Serial.println("");
+
+	graphClient.setBaseUrls(MOCK_SERVER, MOCK_SERVER);
+	graphClient.setClock(virtualClock);
+	graphClient.setKeepAlive(true);
+	graphClient.setCacheEnabled(true);
+	graphClient.setCacheTTL(30UL * 60 * 1000);
+}
+
+void loop()
+{
+	if (currentState == no_context) {
+		// The mock server grants the token immediately
+		if (graphClient.startDeviceLoginFlow(deviceCodeDoc) &&
+			graphClient.pollForToken(pollingDoc, deviceCodeDoc["device_code"].as<const char*>())) {
+			checkLifetimeAfterToken();
+			startFreeHeap = ESP.getFreeHeap();
+			startMaxAlloc = ESP.getMaxAllocHeap();
+			currentState = context_available;
+		} else {
+			Serial.println("Login at mock server failed, retrying.");
+			delay(CYCLE_DELAY);
+		}
+		return;
+	}
+
+	if (currentState == token_needs_refresh || graphClient.getTokenLifetime() <= 60) {
+		if (graphClient.refreshToken()) {
+			refreshCount++;
+			checkLifetimeAfterToken();
+			currentState = context_available;
+		} else {
+			requestErrors++;
+			delay(CYCLE_DELAY);
+			return;
+		}
+	}
+
+	cycle++;
+
+	// Exercise the write path every few cycles
+	if (cycle % 3 == 0) {
+		graphClient.setPresence(cycle % 2 ? "Busy" : "Available", cycle % 2 ? "InACall" : "Available");
+	}
+
+	graphClient.getUserPresence();
+	GraphError gpe = graphClient.getLastError();
+	graphClient.getUserEvents(5, "UTC");
+	GraphError gee = graphClient.getLastError();
+	if (gpe.hasError || gee.hasError) {
+		requestErrors++;
+		if (gpe.tokenNeedsRefresh || gee.tokenNeedsRefresh) {
+			currentState = token_needs_refresh;
+		}
+	}
+
+	GraphCacheStats stats = graphClient.getCacheStats();
+	Serial.printf("cycle: %lu, virtual days: %lu, clock: %lu, lifetime: %d s\n",
+		cycle, (millis() / 1000UL) * TIME_FACTOR / 86400UL, virtualClock(), graphClient.getTokenLifetime());
+	Serial.printf("refreshes: %lu, request errors: %lu, timing errors: %lu, pending writes: %d\n",
+		refreshCount, requestErrors, timingErrors, graphClient.getPendingWriteCount());
+	Serial.printf("heap: %u (%+d), max block: %u (%+d), min free: %u, cache hits/misses: %lu/%lu\n",
+		ESP.getFreeHeap(), (int)(ESP.getFreeHeap() - startFreeHeap),
+		ESP.getMaxAllocHeap(), (int)(ESP.getMaxAllocHeap() - startMaxAlloc),
+		ESP.getMinFreeHeap(), stats.hits, stats.misses);
+
+	delay(CYCLE_DELAY);
+}
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+#
+#	Copyright (c) 2020 Tobias Blum. All rights reserved.
+#
+#	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+#	https://github.com/toblum/ArduinoMSGraph
+#
+#	Local stand-in for Azure AD and Microsoft Graph, used by ESP32_SoakTest.
+#	Answers the device code flow, token refresh, presence, events and setPresence
+#	requests and injects errors (401, 429, 503, dropped connections) at random.
+#
+#	Usage: python3 ESP32_SoakTest_MockServer.py [--port 8080] [--error-rate 0.05] [--seed 1]
+#
+#	This Source Code Form is subject to the terms of the Mozilla Public
+#	License, v. 2.0. If a copy of the MPL was not distributed with this
+#	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+import argparse
+import json
+import random
+import re
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+EXPIRES_IN = 3600
+
+tokens = {}			# access_token -> refresh_token
+refresh_tokens = set()
+presence = {"availability": "Available", "activity": "Available"}
+stats = {"requests": 0, "connections": 0, "refreshes": 0, "injected": 0}
+
+
+def new_tokens():
+	access_token = "at-" + uuid.uuid4().hex
+	refresh_token = "rt-" + uuid.uuid4().hex
+	tokens[access_token] = refresh_token
+	refresh_tokens.add(refresh_token)
+	return {
+		"token_type": "Bearer",
+		"expires_in": EXPIRES_IN,
+		"access_token": access_token,
+		"refresh_token": refresh_token,
+		"id_token": "id-" + uuid.uuid4().hex,
+	}
+
+
+class MockHandler(BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+
+	def setup(self):
+		# One handler per connection, with keep-alive requests grow faster than connections
+		stats["connections"] += 1
+		super().setup()
+
+	def _send_json(self, code, body, headers=None):
+		data = json.dumps(body).encode() if body is not None else b""
+		self.send_response(code)
+		if data:
+			self.send_header("Content-Type", "application/json")
+		self.send_header("Content-Length", str(len(data)))
+		for name, value in (headers or {}).items():
+			self.send_header(name, value)
+		self.end_headers()
+		self.wfile.write(data)
+
+	def _graph_error(self, code, error_code):
+		self._send_json(code, {"error": {"code": error_code, "message": "Injected by mock"}})
+
+	def _inject_error(self, graph):
+		if random.random() >= self.server.error_rate:
+			return False
+		stats["injected"] += 1
+		kind = random.choice(["401", "429", "503", "drop"] if graph else ["429", "503", "drop"])
+		if kind == "401":
+			self._graph_error(401, "InvalidAuthenticationToken")
+		elif kind == "429":
+			self._graph_error(429, "TooManyRequests")
+		elif kind == "503":
+			self._graph_error(503, "ServiceNotAvailable")
+		else:
+			self.close_connection = True
+			self.connection.close()
+		return True
+
+	def _authorized(self):
+		auth = self.headers.get("Authorization", "")
+		if not auth.startswith("Bearer ") or auth[7:] not in tokens:
+			self._graph_error(401, "InvalidAuthenticationToken")
+			return False
+		return True
+
+	def _read_body(self):
+		length = int(self.headers.get("Content-Length", 0))
+		return self.rfile.read(length).decode() if length else ""
+
+	def do_POST(self):
+		stats["requests"] += 1
+		body = self._read_body()
+
+		if re.match(r"^/[^/]+/oauth2/v2.0/devicecode$", self.path):
+			self._send_json(200, {
+				"device_code": "dc-" + uuid.uuid4().hex,
+				"user_code": "MOCK1234",
+				"verification_uri": "http://localhost/devicelogin",
+				"expires_in": 900,
+				"interval": 5,
+				"message": "Mock server, no login needed.",
+			})
+		elif re.match(r"^/[^/]+/oauth2/v2.0/token$", self.path):
+			if self._inject_error(False):
+				return
+			params = dict(p.split("=", 1) for p in body.split("&") if "=" in p)
+			if params.get("grant_type") == "refresh_token":
+				if params.get("refresh_token") not in refresh_tokens:
+					self._send_json(400, {"error": "invalid_grant", "error_description": "Unknown refresh token"})
+					return
+				# Refresh tokens rotate, old access tokens stay valid until they expire
+				refresh_tokens.discard(params["refresh_token"])
+				stats["refreshes"] += 1
+			self._send_json(200, new_tokens())
+		elif self.path in ("/beta/me/presence/setPresence", "/beta/me/presence/setUserPreferredPresence"):
+			if self._inject_error(True) or not self._authorized():
+				return
+			data = json.loads(body or "{}")
+			presence["availability"] = data.get("availability", presence["availability"])
+			presence["activity"] = data.get("activity", presence["activity"])
+			self._send_json(200, None)
+		else:
+			self._graph_error(404, "ResourceNotFound")
+
+	def do_GET(self):
+		stats["requests"] += 1
+		if self._inject_error(True):
+			return
+		if not self._authorized():
+			return
+
+		if self.path == "/beta/me/presence":
+			self._send_json(200, dict(presence, id=str(uuid.UUID(int=1))))
+		elif self.path.startswith("/v1.0/me/events"):
+			etag = '"events-1"'
+			if self.headers.get("If-None-Match") == etag:
+				self._send_json(304, None, {"ETag": etag})
+				return
+			events = [{
+				"id": "event-%d" % i,
+				"subject": "Mock meeting %d" % i,
+				"bodyPreview": "",
+				"start": {"dateTime": "2020-10-20T%02d:00:00.0000000" % (9 + i), "timeZone": "UTC"},
+				"end": {"dateTime": "2020-10-20T%02d:30:00.0000000" % (9 + i), "timeZone": "UTC"},
+				"location": {"displayName": "Room %d" % i},
+			} for i in range(5)]
+			self._send_json(200, {"value": events}, {"ETag": etag})
+		else:
+			self._graph_error(404, "ResourceNotFound")
+
+	def log_message(self, format, *args):
+		print("%s [requests: %d, connections: %d, refreshes: %d, injected: %d]" % (
+			format % args, stats["requests"], stats["connections"], stats["refreshes"], stats["injected"]))
+
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser(description="Mock Azure AD / Graph server for ESP32_SoakTest")
+	parser.add_argument("--port", type=int, default=8080)
+	parser.add_argument("--error-rate", type=float, default=0.05, help="Probability of an injected error per request")
+	parser.add_argument("--seed", type=int, default=None)
+	args = parser.parse_args()
+
+	random.seed(args.seed)
+	server = ThreadingHTTPServer(("0.0.0.0", args.port), MockHandler)
+	server.error_rate = args.error_rate
+	print("Mock server listening on port %d, error rate %.2f" % (args.port, args.error_rate))
+	server.serve_forever()
@@ -12,6 +12,30 @@
 #include "ArduinoMSGraph.h"
 #include "ArduinoMSGraphCerts.h"
 
+#define VALID_EPOCH 1600000000							// Wall clock earlier than this is not synced
+
+#ifdef MSGRAPH_RTC_CONTEXT
+#define RTC_CONTEXT_MAGIC 0x4D534743					// "MSGC", marks valid context in RTC memory
+
+// Context kept in RTC slow memory, survives deep sleep but not power loss
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum;
+	time_t expiresAt;
+	uint32_t userKey;
+	char access_token[MSGRAPH_RTC_TOKEN_SIZE];
+	char refresh_token[MSGRAPH_RTC_TOKEN_SIZE];
+} GraphRTCContext;
+
+RTC_DATA_ATTR static GraphRTCContext rtcContext;
+
+static uint32_t rtcContextChecksum() {
+	uint32_t checksum = GraphResponseCache::hash(rtcContext.access_token);
+	checksum = GraphResponseCache::hash(rtcContext.refresh_token, checksum);
+	return checksum ^ (uint32_t)rtcContext.expiresAt ^ rtcContext.userKey;
+}
+#endif
+
 /**
  * Create a new ArduinoMSGraph instance
  * 
@@ -34,34 +58,61 @@ ArduinoMSGraph::ArduinoMSGraph(Client &client, const char *tenant, const char *c
  * @param payload Raw payload to send together with the request.
  * @param method Method for the HTTP request: GET, POST, ...
  * @param sendAuth If true, send the Bearer token together with the request.
+ * @param extraHeader Additional header, only sent together with the Bearer token.
  * 
- * @returns True if request successful, false on error.
+ * GET responses are cached if enabled, see setCacheEnabled(). Cached responses are revalidated with If-None-Match.
+ * 
+ * @returns True if request successful (or served from cache), false on error.
  */
 bool ArduinoMSGraph::requestJsonApi(JsonDocument& responseDoc, const char *url, const char *payload, const char *method, bool sendAuth, GraphRequestHeader extraHeader) {
-	const char* cert;
-	if (strstr(url, "graph.microsoft.com") != NULL) {
-		cert = rootCACertificateGraph;
-	} else {
-		cert = rootCACertificateLogin;
-	}
-
 	#ifdef MSGRAPH_DEBUG
 		DBG_PRINT("ESP.getFreeHeap(): ");
 		DBG_PRINTLN(ESP.getFreeHeap());
 	#endif
 
-	// HTTPClient
-	HTTPClient https;
+	_lastHttpCode = 0;
+
+	// Serve GET requests from cache if possible
+	GraphCacheEntry *cacheEntry = NULL;
+	uint32_t cacheKey = 0;
+	uint32_t cacheResource = 0;
+	bool cacheable = (strcmp(method, "GET") == 0);
+	if (cacheable) {
+		cacheResource = _resourceKey(url, false);
+		cacheKey = GraphResponseCache::hash(url);
+		cacheKey = GraphResponseCache::hash(extraHeader.name, cacheKey);
+		cacheKey = GraphResponseCache::hash(extraHeader.payload, cacheKey);
+		if (sendAuth) {
+			// Different users (see setContext()) must not share cached responses. userKey is assigned
+			// per login and stays the same across token refreshes, so spilled entries are not orphaned.
+			cacheKey ^= _context.userKey * 2654435761UL;
+		}
+		cacheEntry = _cache.find(cacheKey, cacheResource, _now());
+
+		if (_cache.isFresh(cacheEntry, _now())) {
+			#ifdef MSGRAPH_DEBUG
+				DBG_PRINTLN(F("requestJsonApi() - Served from cache"));
+			#endif
+			responseDoc.set(*cacheEntry->doc);
+			_cache.stats.hits++;
+			return true;
+		}
+	}
+
+	// HTTPClient, with keep-alive one persistent client per host, see _httpClientFor()
+	HTTPClient localHttps;
+	HTTPClient &https = _httpClientFor(url, localHttps);
 
 	// Prepare empty response
 	const int emptyCapacity = JSON_OBJECT_SIZE(1);
 	DynamicJsonDocument emptyDoc(emptyCapacity);
 
 	// DBG_PRINT("[HTTPS] begin...\n");
-    if (https.begin(url, cert)) {
+    if (_beginRequest(https, url)) {
 		https.setConnectTimeout(10000);
 		https.setTimeout(10000);
-		https.useHTTP10(true);
+		https.useHTTP10(!_keepAlive);
+		https.setReuse(_keepAlive);
 
 		// Send auth header?
 		if (sendAuth) {
@@ -76,8 +127,16 @@ bool ArduinoMSGraph::requestJsonApi(JsonDocument& responseDoc, const char *url,
 			#endif
 		}
 
+		// Revalidate cached response
+		if (cacheEntry != NULL && cacheEntry->etag != NULL) {
+			https.addHeader("If-None-Match", cacheEntry->etag);
+		}
+		const char *collectHeaderKeys[] = { "ETag" };
+		https.collectHeaders(collectHeaderKeys, 1);
+
 		// Start connection and send HTTP header
 		int httpCode = https.sendRequest(method, payload);
+		_lastHttpCode = httpCode;
 
 		// httpCode will be negative on error
 		if (httpCode > 0) {
@@ -86,23 +145,58 @@ bool ArduinoMSGraph::requestJsonApi(JsonDocument& responseDoc, const char *url,
 				Serial.printf("requestJsonApi() - Method: %s, Response code: %d\n", method, httpCode);
 			#endif
 
+			// Cached response still valid, skip download and parsing
+			if (httpCode == HTTP_CODE_NOT_MODIFIED && cacheEntry != NULL) {
+				responseDoc.set(*cacheEntry->doc);
+				_cache.revalidate(cacheEntry, _now());
+				https.end();
+				return true;
+			}
+
 			// File found at server (HTTP 200, 301), or HTTP 400, 401 with response payload
-			if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY || httpCode == HTTP_CODE_BAD_REQUEST || httpCode == HTTP_CODE_UNAUTHORIZED) {
-				String payload = https.getString(); 
-				payload.replace("'", ""); // Delete single quotes
+			if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY || httpCode == HTTP_CODE_BAD_REQUEST || httpCode == HTTP_CODE_UNAUTHORIZED || httpCode == HTTP_CODE_NO_CONTENT) {
+				// Bodies with known size are read into a GraphAllocator buffer (PSRAM if enabled)
+				size_t bodyLength = 0;
+				char *body = _readBody(https, bodyLength);
+				String payload;
+				if (body == NULL) {
+					payload = https.getString(); 
+					payload.replace("'", ""); // Delete single quotes
+				}
 				// if (strstr(url, "events") != NULL) {
 				// 	DBG_PRINTLN(payload);
 				// }
 
-				// Parse JSON data
+				// Empty response, e.g. for actions like setPresence
+				if (body == NULL && payload.length() == 0 && (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_NO_CONTENT)) {
+					responseDoc.clear();
+					https.end();
+					return true;
+				}
+
+				// Parse JSON data, const input makes ArduinoJson copy the strings into responseDoc
 				// DeserializationError error = deserializeJson(responseDoc, https.getStream());
-				DeserializationError error = deserializeJson(responseDoc, payload);
+				DeserializationError error;
+				if (body != NULL) {
+					error = deserializeJson(responseDoc, (const char *)body, bodyLength);
+					GraphAllocator().deallocate(body);
+				} else {
+					error = deserializeJson(responseDoc, payload);
+				}
 				if (error) {
 					DBG_PRINT(F("requestJsonApi() - deserializeJson() failed: "));
 					DBG_PRINTLN(error.c_str());
 					https.end();
 					return false;
 				} else {
+					if (cacheable && httpCode == HTTP_CODE_OK && !responseDoc.containsKey("error")) {
+						_cache.stats.misses++;
+						String etag = https.header("ETag");
+						if (etag.length() == 0 && responseDoc.containsKey("@odata.etag")) {
+							etag = responseDoc["@odata.etag"].as<String>();
+						}
+						_cache.store(cacheKey, cacheResource, etag.c_str(), responseDoc, _now());
+					}
 					https.end();
 					return true;
 				}
@@ -124,6 +218,147 @@ bool ArduinoMSGraph::requestJsonApi(JsonDocument& responseDoc, const char *url,
 }
 
 
+/**
+ * Perform an authenticated binary GET request and stream the body to a callback, without
+ * buffering the whole response. If the connection drops or stalls for 10 s, the download is
+ * resumed with a range request. If the server ignores the range, data is delivered again from
+ * offset 0. Without Content-Length, the body is complete when the server closes the connection.
+ * 
+ * @param url URL to request
+ * @param callback Receives the body in chunks of up to MSGRAPH_STREAM_BUFFER_SIZE bytes.
+ * The first call (offset 0) carries the Content-Length in total, e.g. to pre-allocate a buffer.
+ * @param maxRetries Number of resume attempts after a broken download.
+ * 
+ * @returns True if the body was received completely, false on error or abort.
+ */
+bool ArduinoMSGraph::requestBinaryApi(const char *url, GraphDataCallback callback, int maxRetries) {
+	GraphError resultError;
+	size_t offset = 0;
+	size_t total = 0;
+	uint8_t buffer[MSGRAPH_STREAM_BUFFER_SIZE];
+
+	for (int attempt = 0; attempt <= maxRetries; attempt++) {
+		// HTTP/1.0 without reuse, so the raw body is delimited by closing the connection. The
+		// connection is closed afterwards, unread data never reaches the next request on it.
+		HTTPClient localHttps;
+		HTTPClient &https = _httpClientFor(url, localHttps);
+		if (!_beginRequest(https, url)) {
+			DBG_PRINTLN(F("requestBinaryApi() - Unable to connect"));
+			continue;
+		}
+		https.setConnectTimeout(10000);
+		https.setTimeout(10000);
+		https.useHTTP10(true);
+		https.setReuse(false);
+
+		char authHeader[strlen(_context.access_token) + 8];
+		sprintf(authHeader, "Bearer %s", _context.access_token);
+		https.addHeader("Authorization", authHeader);
+
+		if (offset > 0) {
+			char rangeHeader[24];
+			sprintf(rangeHeader, "bytes=%u-", offset);
+			https.addHeader("Range", rangeHeader);
+		}
+
+		int httpCode = https.GET();
+		#ifdef MSGRAPH_DEBUG
+			Serial.printf("requestBinaryApi() - Response code: %d, offset: %u\n", httpCode, offset);
+		#endif
+
+		if (httpCode == HTTP_CODE_OK) {
+			offset = 0;
+			total = (https.getSize() > 0) ? https.getSize() : 0;
+		} else if (httpCode == HTTP_CODE_PARTIAL_CONTENT && offset > 0) {
+			// Resume where the last attempt stopped
+		} else if (httpCode > 0) {
+			// Graph returns a JSON error, e.g. ImageNotFound or InvalidAuthenticationToken
+			DynamicJsonDocument errorDoc(JSON_OBJECT_SIZE(4) + 512);
+			if (!deserializeJson(errorDoc, https.getString()) && errorDoc.containsKey("error")) {
+				_handleApiError(errorDoc, resultError);
+				// Keep the error code (e.g. ImageNotFound) after errorDoc is gone
+				strlcpy(_errorCode, errorDoc["error"]["code"] | "API error", sizeof(_errorCode));
+				resultError.message = _errorCode;
+			} else {
+				resultError.hasError = true;
+				resultError.message = (char *)"Request error";
+			}
+			resultError.httpCode = httpCode;
+			Serial.printf("requestBinaryApi() - Other HTTP code: %d\n", httpCode);
+			https.end();
+			this->_lastError = resultError;
+			return false;
+		} else {
+			Serial.printf("requestBinaryApi() - Request failed: %s\n", https.errorToString(httpCode).c_str());
+			https.end();
+			continue;
+		}
+
+		WiFiClient *stream = https.getStreamPtr();
+		if (stream == NULL) {
+			DBG_PRINTLN(F("requestBinaryApi() - Connection closed before body"));
+			https.end();
+			continue;
+		}
+
+		// Stops on a stall (timeout), a read error or when the server closed the connection
+		bool closedByServer = false;
+		unsigned long lastData = millis();
+		while (total == 0 || offset < total) {
+			size_t available = stream->available();
+			if (available == 0) {
+				if (!stream->connected()) {
+					closedByServer = true;
+					break;
+				}
+				if (millis() - lastData > 10000) {
+					DBG_PRINTLN(F("requestBinaryApi() - Download stalled"));
+					break;
+				}
+				delay(1);
+				continue;
+			}
+
+			int received = stream->readBytes(buffer, min(available, sizeof(buffer)));
+			if (received <= 0) {
+				break;
+			}
+			lastData = millis();
+
+			if (!callback(buffer, received, offset, total)) {
+				DBG_PRINTLN(F("requestBinaryApi() - Aborted by callback"));
+				stream->stop();
+				https.end();
+				resultError.hasError = true;
+				resultError.message = (char *)"Aborted";
+				this->_lastError = resultError;
+				return false;
+			}
+			offset += received;
+		}
+
+		// Without Content-Length the end of the body is only known by the closed connection,
+		// a stalled download may be truncated and is resumed
+		bool complete = (total > 0) ? (offset >= total) : (closedByServer && offset > 0);
+		if (!complete) {
+			stream->stop();
+		}
+		https.end();
+
+		if (complete) {
+			this->_lastError = resultError;
+			return true;
+		}
+		DBG_PRINTLN(F("requestBinaryApi() - Download incomplete, resuming"));
+	}
+
+	resultError.hasError = true;
+	resultError.message = (char *)"Request error";
+	this->_lastError = resultError;
+	return false;
+}
+
+
 /**
  * Start the device login flow and request login page data.
  * 
@@ -139,8 +374,8 @@ bool ArduinoMSGraph::startDeviceLoginFlow(JsonDocument &responseDoc, const char
 		DBG_PRINTLN(scope);
 	#endif
 
-	char url[58 + strlen(this->_tenant)];
-    sprintf(url,"https://login.microsoftonline.com/%s/oauth2/v2.0/devicecode", this->_tenant);
+	char url[26 + strlen(this->_loginBaseUrl) + strlen(this->_tenant)];
+    sprintf(url,"%s/%s/oauth2/v2.0/devicecode", this->_loginBaseUrl, this->_tenant);
 	char payload[18 + strlen(this->_clientId) + strlen(scope)];
     sprintf(payload,"client_id=%s&scope=%s", this->_clientId, scope);
 
@@ -163,8 +398,8 @@ bool ArduinoMSGraph::pollForToken(JsonDocument &responseDoc, const char *device_
 		DBG_PRINTLN(F("pollForToken()"));
 	#endif
 
-	char url[53 + strlen(this->_tenant)];
-    sprintf(url,"https://login.microsoftonline.com/%s/oauth2/v2.0/token", this->_tenant);
+	char url[21 + strlen(this->_loginBaseUrl) + strlen(this->_tenant)];
+    sprintf(url,"%s/%s/oauth2/v2.0/token", this->_loginBaseUrl, this->_tenant);
 	char payload[80 + strlen(this->_clientId) + strlen(device_code)];
     sprintf(payload,"client_id=%s&grant_type=urn:ietf:params:oauth:grant-type:device_code&device_code=%s", this->_clientId, device_code);
 
@@ -184,12 +419,18 @@ bool ArduinoMSGraph::pollForToken(JsonDocument &responseDoc, const char *device_
 		return false;
 	} else {
 		if (responseDoc.containsKey("access_token") && responseDoc.containsKey("refresh_token")) {
+			// A new login is a new user, writes of the previous user are sent with its token
+			if (_context.access_token != NULL) {
+				flushWrites();
+			}
+
 			// Store tokens in context
-			_context.access_token = strdup(responseDoc["access_token"].as<char *>());
-			_context.refresh_token = strdup(responseDoc["refresh_token"].as<char *>());
-			_context.id_token = strdup(responseDoc["id_token"].as<char *>());
+			_setToken(_context.access_token, responseDoc["access_token"].as<char *>());
+			_setToken(_context.refresh_token, responseDoc["refresh_token"].as<char *>());
+			_setToken(_context.id_token, responseDoc["id_token"].as<char *>());
 			unsigned int _expires_in = responseDoc["expires_in"].as<unsigned long>();
-			_context.expires = millis() + (_expires_in * 1000); // Calculate timestamp when token expires
+			_context.expires = _now() + (_expires_in * 1000); // Calculate timestamp when token expires
+			_context.userKey = _newUserKey();
 
 			return true;
 		} else {
@@ -214,33 +455,33 @@ bool ArduinoMSGraph::refreshToken() {
 	// See: https://docs.microsoft.com/de-de/azure/active-directory/develop/v1-protocols-oauth-code#refreshing-the-access-tokens
 
 	bool success = false;
-	char url[53 + strlen(this->_tenant)];
-    sprintf(url, "https://login.microsoftonline.com/%s/oauth2/v2.0/token", this->_tenant);
+	char url[21 + strlen(this->_loginBaseUrl) + strlen(this->_tenant)];
+    sprintf(url, "%s/%s/oauth2/v2.0/token", this->_loginBaseUrl, this->_tenant);
 
 	char payload[51 + strlen(this->_clientId) + strlen(_context.refresh_token)];
     sprintf(payload, "client_id=%s&grant_type=refresh_token&refresh_token=%s", this->_clientId, _context.refresh_token);
 
 	const size_t capacity = JSON_OBJECT_SIZE(7) + 10000;
-	DynamicJsonDocument responseDoc(capacity);
+	GraphJsonDocument responseDoc(capacity);
 
 	bool res = requestJsonApi(responseDoc, url, payload);
 
 	// Replace tokens and expiration
 	if (res && responseDoc.containsKey("access_token") && responseDoc.containsKey("refresh_token")) {
 		if (!responseDoc["access_token"].isNull()) {
-			_context.access_token = strdup(responseDoc["access_token"].as<char *>());
+			_setToken(_context.access_token, responseDoc["access_token"].as<char *>());
 			success = true;
 		}
 		if (!responseDoc["refresh_token"].isNull()) {
-			_context.refresh_token = strdup(responseDoc["refresh_token"].as<char *>());
+			_setToken(_context.refresh_token, responseDoc["refresh_token"].as<char *>());
 			success = true;
 		}
 		if (!responseDoc["id_token"].isNull()) {
-			_context.id_token = strdup(responseDoc["id_token"].as<char *>());
+			_setToken(_context.id_token, responseDoc["id_token"].as<char *>());
 		}
 		if (!responseDoc["expires_in"].isNull()) {
 			int _expires_in = responseDoc["expires_in"].as<unsigned long>();
-			_context.expires = millis() + (_expires_in * 1000); // Calculate timestamp when token expires
+			_context.expires = _now() + (_expires_in * 1000); // Calculate timestamp when token expires
 		}
 
 		#ifdef MSGRAPH_DEBUG
@@ -260,12 +501,19 @@ bool ArduinoMSGraph::refreshToken() {
  * @returns True if saving was successful.
  */
 bool ArduinoMSGraph::saveContextToSPIFFS() {
-	const size_t capacity = JSON_OBJECT_SIZE(3) + 5000;
-	DynamicJsonDocument contextDoc(capacity);
+	const size_t capacity = JSON_OBJECT_SIZE(5) + 5000;
+	GraphJsonDocument contextDoc(capacity);
 
 	contextDoc["access_token"] = _context.access_token;
 	contextDoc["refresh_token"] = _context.refresh_token;
 	contextDoc["id_token"] = _context.id_token;
+	contextDoc["user_key"] = _context.userKey;
+
+	// Absolute expiry only makes sense with a synced wall clock (NTP)
+	time_t now = time(NULL);
+	if (now > VALID_EPOCH) {
+		contextDoc["expires_at"] = now + getTokenLifetime();
+	}
 
 	File contextFile = SPIFFS.open(CONTEXT_FILE, FILE_WRITE);
 	size_t bytesWritten = serializeJsonPretty(contextDoc, contextFile);
@@ -297,8 +545,8 @@ bool ArduinoMSGraph::readContextFromSPIFFS() {
 		if (size == 0) {
 			DBG_PRINTLN(F("readContextFromSPIFFS() - File empty"));
 		} else {
-			const int capacity = JSON_OBJECT_SIZE(3) + 5000;
-			DynamicJsonDocument contextDoc(capacity);
+			const int capacity = JSON_OBJECT_SIZE(5) + 5000;
+			GraphJsonDocument contextDoc(capacity);
 			DeserializationError err = deserializeJson(contextDoc, file);
 
 			if (err) {
@@ -307,17 +555,29 @@ bool ArduinoMSGraph::readContextFromSPIFFS() {
 			} else {
 				int numSettings = 0;
 				if (!contextDoc["access_token"].isNull()) {
-					_context.access_token = strdup(contextDoc["access_token"].as<char *>());
+					_setToken(_context.access_token, contextDoc["access_token"].as<char *>());
 					numSettings++;
 				}
 				if (!contextDoc["refresh_token"].isNull()) {
-					_context.refresh_token = strdup(contextDoc["refresh_token"].as<char *>());
+					_setToken(_context.refresh_token, contextDoc["refresh_token"].as<char *>());
 					numSettings++;
 				}
 				if (!contextDoc["id_token"].isNull()){
-					_context.id_token = strdup(contextDoc["id_token"].as<char *>());
+					_setToken(_context.id_token, contextDoc["id_token"].as<char *>());
+				}
+				// Same key as before the reboot, so persisted writes and spilled cache entries still match
+				_context.userKey = contextDoc["user_key"].as<uint32_t>();
+				if (_context.userKey == 0) {
+					_context.userKey = _newUserKey();
+				}
+				_context.expires = _now();
+				time_t now = time(NULL);
+				if (!contextDoc["expires_at"].isNull() && now > VALID_EPOCH) {
+					long remaining = contextDoc["expires_at"].as<long>() - now;
+					if (remaining > 0) {
+						_context.expires = _now() + (remaining * 1000);
+					}
 				}
-				_context.expires = 0;
 				if (numSettings >= 2) {
 					#ifdef MSGRAPH_DEBUG
 						DBG_PRINTLN(F("readContextFromSPIFFS() - Success"));
@@ -350,6 +610,146 @@ bool ArduinoMSGraph::removeContextFromSPIFFS() {
 }
 
 
+/**
+ * Save pending writes in a JSON file in SPIFFS.
+ * 
+ * @returns True if saving was successful.
+ */
+bool ArduinoMSGraph::saveWritesToSPIFFS() {
+	if (_pendingWrites.empty()) {
+		if (SPIFFS.exists(WRITES_FILE)) {
+			return SPIFFS.remove(WRITES_FILE);
+		}
+		return true;
+	}
+
+	const size_t capacity = JSON_ARRAY_SIZE(MSGRAPH_MAX_PENDING_WRITES) + MSGRAPH_MAX_PENDING_WRITES * JSON_OBJECT_SIZE(3);
+	DynamicJsonDocument writesDoc(capacity);
+	for (size_t i = 0; i < _pendingWrites.size(); i++) {
+		JsonObject write = writesDoc.createNestedObject();
+		write["url"] = (const char *)_pendingWrites[i].url;
+		write["payload"] = (const char *)_pendingWrites[i].payload;
+		write["userKey"] = _pendingWrites[i].userKey;
+	}
+
+	File writesFile = SPIFFS.open(WRITES_FILE, FILE_WRITE);
+	size_t bytesWritten = serializeJson(writesDoc, writesFile);
+	writesFile.close();
+
+	#ifdef MSGRAPH_DEBUG
+		DBG_PRINT(F("saveWritesToSPIFFS() - Success - Bytes written: "));
+		DBG_PRINTLN(bytesWritten);
+	#endif
+
+	return bytesWritten > 0;
+}
+
+
+/**
+ * Restore pending writes from SPIFFS, they are sent with the next request.
+ * 
+ * @returns True if writes were restored.
+ */
+bool ArduinoMSGraph::readWritesFromSPIFFS() {
+	File file = SPIFFS.open(WRITES_FILE);
+	bool success = false;
+
+	if (!file) {
+		DBG_PRINTLN(F("readWritesFromSPIFFS() - No file found"));
+	} else {
+		GraphJsonDocument writesDoc(JSON_ARRAY_SIZE(MSGRAPH_MAX_PENDING_WRITES) + MSGRAPH_MAX_PENDING_WRITES * JSON_OBJECT_SIZE(3) + 2048);
+		DeserializationError err = deserializeJson(writesDoc, file);
+		file.close();
+
+		if (err) {
+			DBG_PRINT(F("readWritesFromSPIFFS() - deserializeJson() failed with code: "));
+			DBG_PRINTLN(err.c_str());
+		} else {
+			for (JsonObject write : writesDoc.as<JsonArray>()) {
+				if (!write["url"].isNull() && !write["payload"].isNull()) {
+					_queueWrite(write["url"].as<const char *>(), write["payload"].as<const char *>(), write["userKey"].as<uint32_t>());
+					success = true;
+				}
+			}
+			#ifdef MSGRAPH_DEBUG
+				Serial.printf("readWritesFromSPIFFS() - Pending writes: %d\n", _pendingWrites.size());
+			#endif
+		}
+	}
+
+	return success;
+}
+
+
+#ifdef MSGRAPH_RTC_CONTEXT
+/**
+ * Save current Graph context in RTC memory, so it can be restored quickly after deep sleep.
+ * The id_token is not stored. The expiry is kept relative to the RTC clock, which keeps
+ * running during deep sleep, so a restored token can be used without refreshing it first.
+ * 
+ * @returns True if saving was successful, false if the tokens are too long.
+ */
+bool ArduinoMSGraph::saveContextToRTC() {
+	if (_context.access_token == NULL || _context.refresh_token == NULL ||
+		strlen(_context.access_token) >= MSGRAPH_RTC_TOKEN_SIZE || strlen(_context.refresh_token) >= MSGRAPH_RTC_TOKEN_SIZE) {
+		DBG_PRINTLN(F("saveContextToRTC() - Tokens do not fit, increase MSGRAPH_RTC_TOKEN_SIZE"));
+		removeContextFromRTC();
+		return false;
+	}
+
+	strcpy(rtcContext.access_token, _context.access_token);
+	strcpy(rtcContext.refresh_token, _context.refresh_token);
+	rtcContext.expiresAt = time(NULL) + getTokenLifetime();
+	rtcContext.userKey = _context.userKey;
+	rtcContext.checksum = rtcContextChecksum();
+	rtcContext.magic = RTC_CONTEXT_MAGIC;
+
+	#ifdef MSGRAPH_DEBUG
+		DBG_PRINTLN(F("saveContextToRTC() - Success"));
+	#endif
+
+	return true;
+}
+
+
+/**
+ * Try to restore Graph context from RTC memory. Only succeeds after a deep sleep wakeup.
+ * 
+ * @returns True if restore was successful.
+ */
+bool ArduinoMSGraph::readContextFromRTC() {
+	if (rtcContext.magic != RTC_CONTEXT_MAGIC || rtcContext.checksum != rtcContextChecksum()) {
+		#ifdef MSGRAPH_DEBUG
+			DBG_PRINTLN(F("readContextFromRTC() - No valid context"));
+		#endif
+		return false;
+	}
+
+	_setToken(_context.access_token, rtcContext.access_token);
+	_setToken(_context.refresh_token, rtcContext.refresh_token);
+	_setToken(_context.id_token, NULL);
+	_context.userKey = (rtcContext.userKey != 0) ? rtcContext.userKey : _newUserKey();
+
+	long remaining = rtcContext.expiresAt - time(NULL);
+	_context.expires = _now() + ((remaining > 0) ? remaining * 1000 : 0);
+
+	#ifdef MSGRAPH_DEBUG
+		Serial.printf("readContextFromRTC() - Success, token valid for %ld s.\n", remaining);
+	#endif
+
+	return true;
+}
+
+
+/**
+ * Invalidate the context stored in RTC memory.
+ */
+void ArduinoMSGraph::removeContextFromRTC() {
+	rtcContext.magic = 0;
+}
+#endif
+
+
 /**
  * Get presence information of the current user
  * 
@@ -360,15 +760,20 @@ GraphPresence ArduinoMSGraph::getUserPresence() {
 	GraphError resultError;
 	GraphPresence result;
 
+	flushWrites();
+
 	const size_t capacity = JSON_OBJECT_SIZE(4) + 512;
 	DynamicJsonDocument responseDoc(capacity);
 
-	bool res = requestJsonApi(responseDoc, "https://graph.microsoft.com/beta/me/presence", "", "GET", true);
+	char url[18 + strlen(this->_graphBaseUrl)];
+	sprintf(url, "%s/beta/me/presence", this->_graphBaseUrl);
+
+	bool res = requestJsonApi(responseDoc, url, "", "GET", true);
 	// serializeJsonPretty(responseDoc, Serial);
 
 	if (!res) {
 		resultError.hasError = true;
-		resultError.message = strdup("Request error");
+		resultError.message = (char *)"Request error";
 	} else if (responseDoc.containsKey("error")) {
 		_handleApiError(responseDoc, resultError);
 	} else {
@@ -389,6 +794,11 @@ GraphPresence ArduinoMSGraph::getUserPresence() {
  * @param count Number of events of request.
  * @param timezone Timezone in which the times should be returned. Default "Europe/Berlin"
  * 
+ * Start and end are also parsed to unix time (GraphDate.epoch) for use with GraphTimeline.
+ * With timezone "UTC" the epoch values are exact. For any other timezone, the device timezone
+ * (configTzTime() or TZ) must be set to the same zone, e.g. "CET-1CEST,M3.5.0,M10.5.0/3" for
+ * "Europe/Berlin". Without a device timezone, epoch is 0 and the events are not in the timeline.
+ * 
  * @returns Vector of GraphEvent structures to hold the result.
  */
 std::vector<GraphEvent> ArduinoMSGraph::getUserEvents(int count, const char *timezone) {
@@ -396,11 +806,13 @@ std::vector<GraphEvent> ArduinoMSGraph::getUserEvents(int count, const char *tim
 	GraphError resultError;
 	std::vector<GraphEvent> result;
 
+	flushWrites();
+
 	const size_t capacity = 10000;
-	DynamicJsonDocument responseDoc(capacity);
+	GraphJsonDocument responseDoc(capacity);
 
-	char url[97 + 3];
-    sprintf(url, "https://graph.microsoft.com/v1.0/me/events?$select=subject,start,end,location,bodyPreview&$top=%d", count);
+	char url[70 + strlen(this->_graphBaseUrl) + 12];
+    sprintf(url, "%s/v1.0/me/events?$select=subject,start,end,location,bodyPreview&$top=%d", this->_graphBaseUrl, count);
 
 	char timezoneParam[129];
 	sprintf(timezoneParam, "outlook.timezone=\"%s\"", timezone);
@@ -411,7 +823,7 @@ std::vector<GraphEvent> ArduinoMSGraph::getUserEvents(int count, const char *tim
 
 	if (!res) {
 		resultError.hasError = true;
-		resultError.message = strdup("Request error");
+		resultError.message = (char *)"Request error";
 	} else if (responseDoc.containsKey("error")) {
 		_handleApiError(responseDoc, resultError);
 	} else {
@@ -429,6 +841,8 @@ std::vector<GraphEvent> ArduinoMSGraph::getUserEvents(int count, const char *tim
 				event.startDate.timeZone = (char *)item["start"]["timeZone"].as<char *>();
 				event.endDate.dateTime = (char *)item["end"]["dateTime"].as<char *>();
 				event.endDate.timeZone = (char *)item["end"]["timeZone"].as<char *>();
+				event.startDate.epoch = _parseDateTime(event.startDate.dateTime, event.startDate.timeZone);
+				event.endDate.epoch = _parseDateTime(event.endDate.dateTime, event.endDate.timeZone);
 
 				result.push_back(event);
 			}
@@ -440,6 +854,233 @@ std::vector<GraphEvent> ArduinoMSGraph::getUserEvents(int count, const char *tim
 }
 
 
+/**
+ * Download the photo (JPEG) of the current or another user and stream it to a callback,
+ * so decoding can start before the download is complete. Requires scope User.Read
+ * (User.ReadBasic.All for other users). To write the photo to a file, pass a callback
+ * calling file.write().
+ * 
+ * @param callback Receives the image data, see requestBinaryApi().
+ * @param size Size variant, e.g. "48x48", "64x64", "96x96". Default NULL (largest available)
+ * @param userId ID or userPrincipalName of another user. Default NULL (current user)
+ * 
+ * @returns True if the photo was received completely.
+ */
+bool ArduinoMSGraph::getUserPhoto(GraphDataCallback callback, const char *size, const char *userId) {
+	// See: https://docs.microsoft.com/en-us/graph/api/profilephoto-get?view=graph-rest-1.0
+	char url[40 + strlen(this->_graphBaseUrl) + (userId != NULL ? strlen(userId) : 0) + (size != NULL ? strlen(size) : 0)];
+	int len = sprintf(url, "%s/v1.0/", this->_graphBaseUrl);
+	if (userId != NULL) {
+		len += sprintf(url + len, "users/%s/", userId);
+	} else {
+		len += sprintf(url + len, "me/");
+	}
+	if (size != NULL) {
+		sprintf(url + len, "photos/%s/$value", size);
+	} else {
+		sprintf(url + len, "photo/$value");
+	}
+
+	return requestBinaryApi(url, callback);
+}
+
+
+/**
+ * Download the photo of the current or another user into a caller provided buffer.
+ * 
+ * @param buffer Buffer to hold the image data
+ * @param bufferSize Size of buffer, the download fails if the photo is larger.
+ * @param length Set to the number of bytes received.
+ * @param size Size variant, e.g. "48x48". Default NULL (largest available)
+ * @param userId ID or userPrincipalName of another user. Default NULL (current user)
+ * 
+ * @returns True if the photo was received completely.
+ */
+bool ArduinoMSGraph::getUserPhoto(uint8_t *buffer, size_t bufferSize, size_t &length, const char *size, const char *userId) {
+	length = 0;
+	return getUserPhoto([&](const uint8_t *data, size_t dataLength, size_t offset, size_t total) {
+		if (total > bufferSize || offset + dataLength > bufferSize) {
+			DBG_PRINTLN(F("getUserPhoto() - Buffer too small"));
+			return false;
+		}
+		memcpy(buffer + offset, data, dataLength);
+		length = offset + dataLength;
+		return true;
+	}, size, userId);
+}
+
+
+/**
+ * Set the presence of the current user for this application (requires scope Presence.ReadWrite).
+ * The request is queued, see queueWrite().
+ * 
+ * @param availability Availability, e.g. "Available", "Busy", "Away"
+ * @param activity Activity, e.g. "Available", "InACall", "Away"
+ * @param expirationDuration ISO 8601 duration, between PT5M and PT4H. Default "PT1H"
+ * 
+ * @returns True if queued.
+ */
+bool ArduinoMSGraph::setPresence(const char *availability, const char *activity, const char *expirationDuration) {
+	// See: https://docs.microsoft.com/en-us/graph/api/presence-setpresence?view=graph-rest-beta
+	StaticJsonDocument<JSON_OBJECT_SIZE(4)> payloadDoc;
+	payloadDoc["sessionId"] = this->_clientId;
+	payloadDoc["availability"] = availability;
+	payloadDoc["activity"] = activity;
+	payloadDoc["expirationDuration"] = expirationDuration;
+
+	char payload[measureJson(payloadDoc) + 1];
+	serializeJson(payloadDoc, payload, sizeof(payload));
+
+	char url[30 + strlen(this->_graphBaseUrl)];
+	sprintf(url, "%s/beta/me/presence/setPresence", this->_graphBaseUrl);
+
+	return queueWrite(url, payload);
+}
+
+
+/**
+ * Set the preferred presence of the current user (requires scope Presence.ReadWrite).
+ * The request is queued, see queueWrite().
+ * 
+ * @param availability Availability, e.g. "Available", "Busy", "DoNotDisturb"
+ * @param activity Activity, e.g. "Available", "Busy", "DoNotDisturb"
+ * @param expirationDuration ISO 8601 duration. Default "PT8H"
+ * 
+ * @returns True if queued.
+ */
+bool ArduinoMSGraph::setUserPreferredPresence(const char *availability, const char *activity, const char *expirationDuration) {
+	// See: https://docs.microsoft.com/en-us/graph/api/presence-setuserpreferredpresence?view=graph-rest-beta
+	StaticJsonDocument<JSON_OBJECT_SIZE(3)> payloadDoc;
+	payloadDoc["availability"] = availability;
+	payloadDoc["activity"] = activity;
+	payloadDoc["expirationDuration"] = expirationDuration;
+
+	char payload[measureJson(payloadDoc) + 1];
+	serializeJson(payloadDoc, payload, sizeof(payload));
+
+	char url[43 + strlen(this->_graphBaseUrl)];
+	sprintf(url, "%s/beta/me/presence/setUserPreferredPresence", this->_graphBaseUrl);
+
+	return queueWrite(url, payload);
+}
+
+
+/**
+ * Queue a JSON POST request for the current user. A pending write of the same user to the
+ * same URL is replaced, so only the latest state is sent. Pending writes are sent before the
+ * next getUserPresence() or getUserEvents() call of that user, or with flushWrites().
+ * 
+ * @param url URL to request
+ * @param payload JSON payload
+ * 
+ * @returns True if queued, false if the queue is full.
+ */
+bool ArduinoMSGraph::queueWrite(const char *url, const char *payload) {
+	return _queueWrite(url, payload, _context.userKey);
+}
+
+
+/**
+ * Queue a JSON POST request for the given user, see queueWrite().
+ */
+bool ArduinoMSGraph::_queueWrite(const char *url, const char *payload, uint32_t userKey) {
+	bool queued = false;
+	for (size_t i = 0; i < _pendingWrites.size(); i++) {
+		if (_pendingWrites[i].userKey == userKey && strcmp(_pendingWrites[i].url, url) == 0) {
+			free(_pendingWrites[i].payload);
+			_pendingWrites[i].payload = strdup(payload);
+			queued = true;
+			break;
+		}
+	}
+
+	if (!queued) {
+		if (_pendingWrites.size() >= MSGRAPH_MAX_PENDING_WRITES) {
+			DBG_PRINTLN(F("queueWrite() - Queue full"));
+			return false;
+		}
+		GraphPendingWrite write = { strdup(url), strdup(payload), userKey };
+		_pendingWrites.push_back(write);
+	}
+
+	#ifdef MSGRAPH_DEBUG
+		Serial.printf("queueWrite() - %s, pending: %d\n", url, _pendingWrites.size());
+	#endif
+
+	if (_persistWrites) {
+		saveWritesToSPIFFS();
+	}
+	return true;
+}
+
+
+/**
+ * Send all pending writes of the current user. Writes rejected by the API (4xx) are dropped.
+ * On connection errors, an expired token (401), throttling (429) or server errors (5xx)
+ * the remaining writes stay queued. Cached responses of the written resource are dropped.
+ * 
+ * @returns True if no writes of the current user are pending anymore.
+ */
+bool ArduinoMSGraph::flushWrites() {
+	GraphRequestHeader extraHeader = { "Content-Type", "application/json" };
+	const size_t capacity = JSON_OBJECT_SIZE(4) + 512;
+	DynamicJsonDocument responseDoc(capacity);
+
+	bool changed = false;
+	bool retryLater = false;
+	size_t i = 0;
+	while (i < _pendingWrites.size()) {
+		GraphPendingWrite &write = _pendingWrites[i];
+		if (write.userKey != _context.userKey) {
+			i++;
+			continue;
+		}
+
+		requestJsonApi(responseDoc, write.url, write.payload, "POST", true, extraHeader);
+
+		if (_lastHttpCode <= 0 || _lastHttpCode == HTTP_CODE_UNAUTHORIZED || _lastHttpCode == HTTP_CODE_TOO_MANY_REQUESTS || _lastHttpCode >= 500) {
+			retryLater = true;
+			break;
+		} else if (_lastHttpCode >= 200 && _lastHttpCode < 300) {
+			// e.g. setPresence changes /me/presence
+			_cache.invalidate(_resourceKey(write.url, true));
+		} else {
+			Serial.printf("flushWrites() - HTTP code %d, dropped write to %s\n", _lastHttpCode, write.url);
+		}
+
+		free(write.url);
+		free(write.payload);
+		_pendingWrites.erase(_pendingWrites.begin() + i);
+		changed = true;
+	}
+
+	if (_persistWrites && changed) {
+		saveWritesToSPIFFS();
+	}
+	return !retryLater;
+}
+
+
+/**
+ * Return number of queued writes
+ * 
+ * @returns Number of pending writes
+ */
+size_t ArduinoMSGraph::getPendingWriteCount() {
+	return _pendingWrites.size();
+}
+
+
+/**
+ * Save the queue to SPIFFS whenever it changes, restore it with readWritesFromSPIFFS() after reboot.
+ * 
+ * @param enabled True to persist pending writes
+ */
+void ArduinoMSGraph::setPersistWrites(bool enabled) {
+	this->_persistWrites = enabled;
+}
+
+
 /**
  * Handle erros returned in errorDoc and set errorObject accordingly
  * 
@@ -465,13 +1106,220 @@ void ArduinoMSGraph::_handleApiError(JsonDocument &errorDoc, GraphError &errorOb
 }
 
 
+/**
+ * Parse a Graph dateTime (e.g. "2020-10-20T09:00:00.0000000") to unix time.
+ * UTC times are converted directly. Other timezones are interpreted as local time, so the
+ * device timezone (configTzTime() or TZ) must match the timezone passed to getUserEvents().
+ * 
+ * @param dateTime Date and time without offset as returned by Graph
+ * @param timeZone Timezone returned together with dateTime
+ * 
+ * @returns Unix time, 0 if dateTime could not be parsed or no device timezone is set
+ */
+time_t ArduinoMSGraph::_parseDateTime(const char *dateTime, const char *timeZone) {
+	int year, month, day, hour, minute, second;
+	if (dateTime == NULL || sscanf(dateTime, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6) {
+		return 0;
+	}
+
+	if (timeZone == NULL || strcmp(timeZone, "UTC") == 0 || strcmp(timeZone, "Etc/UTC") == 0) {
+		// Days since 1970-01-01, see: http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+		year -= month <= 2;
+		long era = (year >= 0 ? year : year - 399) / 400;
+		long yoe = year - era * 400;
+		long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+		long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		long days = era * 146097 + doe - 719468;
+		return (time_t)days * 86400 + hour * 3600 + minute * 60 + second;
+	}
+
+	// mktime() would silently use UTC, which is off by the zone offset
+	const char *deviceTimeZone = getenv("TZ");
+	if (deviceTimeZone == NULL || strlen(deviceTimeZone) == 0) {
+		#ifdef MSGRAPH_DEBUG
+			Serial.printf("_parseDateTime() - No device timezone set, cannot convert time in %s\n", timeZone);
+		#endif
+		return 0;
+	}
+
+	struct tm timeinfo = {};
+	timeinfo.tm_year = year - 1900;
+	timeinfo.tm_mon = month - 1;
+	timeinfo.tm_mday = day;
+	timeinfo.tm_hour = hour;
+	timeinfo.tm_min = minute;
+	timeinfo.tm_sec = second;
+	timeinfo.tm_isdst = -1;
+	time_t result = mktime(&timeinfo);
+	return (result == (time_t)-1) ? 0 : result;
+}
+
+
 /**
  * Return access token lifetime in seconds
  * 
  * @returns Token lifetime in seconds
  */
 int ArduinoMSGraph::getTokenLifetime() {
-	return (_context.expires - millis()) / 1000;
+	// Signed difference stays correct when the clock wraps (after ~49.7 days)
+	return (long)(_context.expires - _now()) / 1000;
+}
+
+
+/**
+ * Enable caching of GET responses (disabled by default). Each cached response keeps a copy of
+ * the JsonDocument (up to MSGRAPH_CACHE_MAX_SIZE bytes, MSGRAPH_CACHE_ENTRIES entries) in RAM,
+ * in PSRAM if MSGRAPH_USE_PSRAM is defined. Disabling releases the memory.
+ * 
+ * @param enabled True to enable the cache
+ */
+void ArduinoMSGraph::setCacheEnabled(bool enabled) {
+	_cache.setEnabled(enabled);
+}
+
+
+/**
+ * Set the time GET responses are served from cache without contacting the server.
+ * With 0 (default), only responses with ETag are cached and revalidated on every request.
+ * Requires setCacheEnabled(true).
+ * 
+ * @param ttl Time to live in ms
+ */
+void ArduinoMSGraph::setCacheTTL(unsigned long ttl) {
+	_cache.setTTL(ttl);
+}
+
+
+/**
+ * Also store cached responses with ETag in SPIFFS, so they survive eviction and reboots.
+ * 
+ * @param enabled True to enable flash spill
+ */
+void ArduinoMSGraph::setCacheFlashSpill(bool enabled) {
+	_cache.setFlashSpill(enabled);
+}
+
+
+/**
+ * Remove all cached responses from RAM and SPIFFS.
+ */
+void ArduinoMSGraph::clearCache() {
+	#ifdef MSGRAPH_DEBUG
+		DBG_PRINTLN(F("clearCache()"));
+	#endif
+
+	_cache.clear();
+}
+
+
+/**
+ * Return hit/miss counters of the response cache
+ * 
+ * @returns Cache statistics
+ */
+GraphCacheStats ArduinoMSGraph::getCacheStats() {
+	return _cache.stats;
+}
+
+
+/**
+ * Keep TLS connections to login and Graph open between requests, saving a handshake per request.
+ * Each open connection holds the TLS buffers in RAM. With CORE_DEBUG_LEVEL 4 (debug), HTTPClient
+ * logs "already connected" for every request that reuses the connection.
+ * 
+ * @param enabled True to enable keep-alive (HTTP/1.1), false to close after each request (default).
+ */
+void ArduinoMSGraph::setKeepAlive(bool enabled) {
+	this->_keepAlive = enabled;
+	if (!enabled) {
+		_httpGraph.setReuse(false);
+		_httpGraph.end();
+		_httpLogin.setReuse(false);
+		_httpLogin.end();
+		_secureGraph.stop();
+		_secureLogin.stop();
+	}
+}
+
+
+/**
+ * Return a copy of the current authentication context. The tokens are copied and must be
+ * released with freeContext(). Tokens change with every refreshToken(), so call getContext()
+ * again after a refresh, otherwise the saved copy holds outdated tokens.
+ * 
+ * @returns Authentication context, owned by the caller
+ */
+GraphAuthContext ArduinoMSGraph::getContext() {
+	GraphAuthContext context;
+	_setToken(context.access_token, this->_context.access_token);
+	_setToken(context.refresh_token, this->_context.refresh_token);
+	_setToken(context.id_token, this->_context.id_token);
+	context.expires = this->_context.expires;
+	context.userKey = this->_context.userKey;
+	return context;
+}
+
+
+/**
+ * Replace the authentication context, e.g. to serve multiple users with one instance.
+ * The tokens are copied, the caller keeps ownership of context. The userKey separates cached
+ * responses and queued writes of different users. Contexts from getContext() already carry it,
+ * a context without userKey (0) gets a new one, which is written back to context.
+ * 
+ * @param context Authentication context, e.g. from getContext()
+ */
+void ArduinoMSGraph::setContext(GraphAuthContext &context) {
+	if (context.userKey == 0) {
+		context.userKey = _newUserKey();
+	}
+
+	// Writes are sent with the token of the user who queued them
+	if (context.userKey != _context.userKey && _context.access_token != NULL) {
+		flushWrites();
+	}
+
+	_setToken(_context.access_token, context.access_token);
+	_setToken(_context.refresh_token, context.refresh_token);
+	_setToken(_context.id_token, context.id_token);
+	_context.expires = context.expires;
+	_context.userKey = context.userKey;
+}
+
+
+/**
+ * Release the tokens of a context returned by getContext().
+ * 
+ * @param context Authentication context to release, the tokens are set to NULL.
+ */
+void ArduinoMSGraph::freeContext(GraphAuthContext &context) {
+	_setToken(context.access_token, NULL);
+	_setToken(context.refresh_token, NULL);
+	_setToken(context.id_token, NULL);
+}
+
+
+/**
+ * Send requests to other endpoints than Azure AD and Microsoft Graph, e.g. a local mock server
+ * for testing. Plain "http://" URLs are supported for this purpose.
+ * 
+ * @param loginBaseUrl Replaces "https://login.microsoftonline.com", without trailing slash.
+ * @param graphBaseUrl Replaces "https://graph.microsoft.com", without trailing slash.
+ * @param rootCACertificate Root certificate for both endpoints. Default NULL (built-in certificates)
+ */
+void ArduinoMSGraph::setBaseUrls(const char *loginBaseUrl, const char *graphBaseUrl, const char *rootCACertificate) {
+	this->_loginBaseUrl = loginBaseUrl;
+	this->_graphBaseUrl = graphBaseUrl;
+	this->_rootCACertificate = rootCACertificate;
+}
+
+
+/**
+ * Replace the clock used for token expiry and cache timestamps, e.g. by a virtual clock for testing.
+ * 
+ * @param clock Function returning a timestamp in ms, may wrap around. NULL restores millis().
+ */
+void ArduinoMSGraph::setClock(GraphClock clock) {
+	this->_clock = (clock != NULL) ? clock : millis;
 }
 
 
@@ -482,4 +1330,170 @@ int ArduinoMSGraph::getTokenLifetime() {
  */
 GraphError ArduinoMSGraph::getLastError() {
 	return this->_lastError;
+}
+
+
+/**
+ * Return current timestamp of the configured clock
+ * 
+ * @returns Timestamp in ms
+ */
+unsigned long ArduinoMSGraph::_now() {
+	return this->_clock();
+}
+
+
+/**
+ * Create a key for a new user, see GraphAuthContext.userKey. Random instead of a counter,
+ * so keys stay distinct from keys restored from SPIFFS after a reboot.
+ * 
+ * @returns Nonzero key
+ */
+uint32_t ArduinoMSGraph::_newUserKey() {
+	uint32_t key;
+	do {
+		key = esp_random();
+	} while (key == 0 || key == _context.userKey);
+	return key;
+}
+
+
+/**
+ * Replace a token in the context, freeing the previous value.
+ * 
+ * @param token Token to replace
+ * @param value New value, will be copied. May be NULL.
+ */
+void ArduinoMSGraph::_setToken(char *&token, const char *value) {
+	if (token == value) {
+		return;
+	}
+	if (token != NULL) {
+		free(token);
+	}
+	token = (value != NULL) ? strdup(value) : NULL;
+}
+
+
+/**
+ * Read the response body into a buffer from GraphAllocator and delete single quotes.
+ * Only used if the size is known (Content-Length), chunked responses or a closed connection return NULL.
+ * 
+ * @param https HTTPClient after sendRequest()
+ * @param length Set to the length of the body
+ * 
+ * @returns Buffer to be released with GraphAllocator, NULL if the body was not read.
+ */
+char *ArduinoMSGraph::_readBody(HTTPClient &https, size_t &length) {
+	int size = https.getSize();
+	WiFiClient *stream = https.getStreamPtr();
+	if (size <= 0 || stream == NULL) {
+		return NULL;
+	}
+
+	char *body = (char *)GraphAllocator().allocate(size + 1);
+	if (body == NULL) {
+		return NULL;
+	}
+
+	size_t received = stream->readBytes(body, size);
+
+	// Delete single quotes in place
+	length = 0;
+	for (size_t i = 0; i < received; i++) {
+		if (body[i] != '\'') {
+			body[length++] = body[i];
+		}
+	}
+	body[length] = '\0';
+
+	return body;
+}
+
+
+/**
+ * Check if a URL belongs to the Graph endpoint (or the login endpoint otherwise).
+ * 
+ * @param url URL to check
+ * 
+ * @returns True for Graph URLs
+ */
+bool ArduinoMSGraph::_isGraphUrl(const char *url) {
+	return strncmp(url, this->_graphBaseUrl, strlen(this->_graphBaseUrl)) == 0;
+}
+
+
+/**
+ * Start a request with the matching root certificate.
+ * 
+ * @param https HTTPClient to start
+ * @param url URL to request
+ * 
+ * @returns True if HTTPClient.begin() was successful.
+ */
+bool ArduinoMSGraph::_beginRequest(HTTPClient &https, const char *url) {
+	// Plain HTTP is only used for local test servers, see setBaseUrls()
+	if (strncmp(url, "http://", 7) == 0) {
+		return https.begin(url);
+	}
+
+	bool isGraph = _isGraphUrl(url);
+	const char* cert;
+	if (this->_rootCACertificate != NULL) {
+		cert = this->_rootCACertificate;
+	} else if (isGraph) {
+		cert = rootCACertificateGraph;
+	} else {
+		cert = rootCACertificateLogin;
+	}
+
+	// begin(url, cert) creates a new WiFiClientSecure for every request, so for keep-alive
+	// the persistent client of the host is passed in, see _httpClientFor()
+	if (_keepAlive) {
+		WiFiClientSecure &secureClient = isGraph ? _secureGraph : _secureLogin;
+		secureClient.setCACert(cert);
+		return https.begin(secureClient, url);
+	}
+	return https.begin(url, cert);
+}
+
+
+/**
+ * Select the HTTPClient for a request. With keep-alive, the persistent HTTPClient of the host is
+ * returned. It must outlive the request, because ~HTTPClient() stops the underlying connection.
+ * 
+ * @param url URL to request
+ * @param localHttps HTTPClient of the caller, used without keep-alive
+ * 
+ * @returns HTTPClient to use for the request
+ */
+HTTPClient &ArduinoMSGraph::_httpClientFor(const char *url, HTTPClient &localHttps) {
+	if (!_keepAlive) {
+		return localHttps;
+	}
+	return _isGraphUrl(url) ? _httpGraph : _httpLogin;
+}
+
+
+/**
+ * Hash the resource part of a URL (without query), used to invalidate cached responses.
+ * 
+ * @param url URL of the request
+ * @param parent If true, remove the last path segment (action URL, e.g. /me/presence/setPresence)
+ * 
+ * @returns Hash of the resource
+ */
+uint32_t ArduinoMSGraph::_resourceKey(const char *url, bool parent) {
+	String resource = url;
+	int queryStart = resource.indexOf('?');
+	if (queryStart >= 0) {
+		resource.remove(queryStart);
+	}
+	if (parent) {
+		int lastSlash = resource.lastIndexOf('/');
+		if (lastSlash >= 0) {
+			resource.remove(lastSlash);
+		}
+	}
+	return GraphResponseCache::hash(resource.c_str());
 }
\ No newline at end of file
@@ -18,26 +18,51 @@
 #define DBG_PRINTLN(x) Serial.println(x)
 
 #define CONTEXT_FILE "/graph_context.json"			// Filename of the context file
+#define WRITES_FILE "/graph_writes.json"			// Filename of the pending writes file
+
+#ifndef MSGRAPH_STREAM_BUFFER_SIZE
+#define MSGRAPH_STREAM_BUFFER_SIZE 512				// Chunk size for binary downloads
+#endif
+
+#ifndef MSGRAPH_MAX_PENDING_WRITES
+#define MSGRAPH_MAX_PENDING_WRITES 8				// Max. number of queued writes to different URLs
+#endif
+
+// Define MSGRAPH_RTC_CONTEXT (e.g. build_flags = -DMSGRAPH_RTC_CONTEXT) to enable saveContextToRTC().
+// This reserves 2 * MSGRAPH_RTC_TOKEN_SIZE bytes of the RTC slow memory (8 KB on ESP32).
+#ifndef MSGRAPH_RTC_TOKEN_SIZE
+#define MSGRAPH_RTC_TOKEN_SIZE 2800					// Max. token length kept in RTC memory (access & refresh token)
+#endif
 
 #include <Arduino.h>
 #include <vector>
+#include <functional>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
+#include <WiFiClientSecure.h>
 #include "SPIFFS.h"
+#include "ArduinoMSGraphCache.h"
 
 typedef struct {
 	bool hasError = false;
 	bool tokenNeedsRefresh = false;
 	char *message;
+	int httpCode = 0;		// HTTP status if known, e.g. 404 for a user without photo
 } GraphError;
 
 typedef struct {
-	char *access_token;
-	char *refresh_token;	// https://docs.microsoft.com/en-us/linkedin/shared/authentication/programmatic-refresh-tokens#sample-response
-	char *id_token;
-	unsigned long expires;
+	char *access_token = NULL;
+	char *refresh_token = NULL;	// https://docs.microsoft.com/en-us/linkedin/shared/authentication/programmatic-refresh-tokens#sample-response
+	char *id_token = NULL;
+	unsigned long expires = 0;
+	uint32_t userKey = 0;		// Identifies the user, assigned with each login, see setContext()
 } GraphAuthContext;
 
+typedef unsigned long (*GraphClock)(void);
+
+// Receives a chunk of a binary download. total is the full size (0 if unknown). Return false to abort.
+typedef std::function<bool(const uint8_t *data, size_t length, size_t offset, size_t total)> GraphDataCallback;
+
 typedef struct {
 	const char *name;
 	const char *payload;
@@ -52,6 +77,7 @@ typedef struct {
 typedef struct {
 	char *dateTime;
 	char *timeZone;
+	time_t epoch;		// dateTime parsed to unix time, 0 if invalid. Needs timezone "UTC" or matching device TZ, see getUserEvents()
 } GraphDate;
 
 typedef struct {
@@ -63,6 +89,14 @@ typedef struct {
 	GraphDate endDate;
 } GraphEvent;
 
+#include "ArduinoMSGraphTimeline.h"
+
+typedef struct {
+	char *url;
+	char *payload;
+	uint32_t userKey;	// GraphAuthContext.userKey of the user who queued the write
+} GraphPendingWrite;
+
 
 class ArduinoMSGraph {
 public:
@@ -73,15 +107,40 @@ public:
 
 	// Generic Request Methods
 	bool requestJsonApi(JsonDocument &doc, const char *url, const char *payload = "", const char *method = "POST", bool sendAuth = false, GraphRequestHeader extraHeader = { NULL, NULL });
+	bool requestBinaryApi(const char *url, GraphDataCallback callback, int maxRetries = 2);
 
 	// Helper
 	int getTokenLifetime();
 	GraphError getLastError();
+	void setClock(GraphClock clock);
+	void setKeepAlive(bool enabled);
+	void setBaseUrls(const char *loginBaseUrl, const char *graphBaseUrl, const char *rootCACertificate = NULL);
+
+	// Context Helper (multiple users)
+	GraphAuthContext getContext();
+	void setContext(GraphAuthContext &context);
+	void freeContext(GraphAuthContext &context);
+
+	// Cache Helper
+	void setCacheEnabled(bool enabled);
+	void setCacheTTL(unsigned long ttl);
+	void setCacheFlashSpill(bool enabled);
+	void clearCache();
+	GraphCacheStats getCacheStats();
 
 	// SPIFFS Helper
 	bool saveContextToSPIFFS();
 	bool readContextFromSPIFFS();
 	bool removeContextFromSPIFFS();
+	bool saveWritesToSPIFFS();
+	bool readWritesFromSPIFFS();
+
+	// RTC Helper (fast resume after deep sleep)
+	#ifdef MSGRAPH_RTC_CONTEXT
+	bool saveContextToRTC();
+	bool readContextFromRTC();
+	void removeContextFromRTC();
+	#endif
 
 	// Authentication Methods
 	bool startDeviceLoginFlow(JsonDocument &doc, const char *scope = "offline_access%20openid%20Presence.Read");
@@ -91,15 +150,52 @@ public:
 	// Graph Data Methods
 	GraphPresence getUserPresence();
 	std::vector<GraphEvent> getUserEvents(int count = 3, const char *timezone = "Europe/Berlin");
+	bool getUserPhoto(GraphDataCallback callback, const char *size = NULL, const char *userId = NULL);
+	bool getUserPhoto(uint8_t *buffer, size_t bufferSize, size_t &length, const char *size = NULL, const char *userId = NULL);
+
+	// Graph Write Methods (queued, sent with the next request or flushWrites())
+	bool setPresence(const char *availability, const char *activity, const char *expirationDuration = "PT1H");
+	bool setUserPreferredPresence(const char *availability, const char *activity, const char *expirationDuration = "PT8H");
+	bool queueWrite(const char *url, const char *payload);
+	bool flushWrites();
+	size_t getPendingWriteCount();
+	void setPersistWrites(bool enabled);
 
 private:
 	const char *_clientId;
 	const char *_tenant;
+	const char *_loginBaseUrl = "https://login.microsoftonline.com";
+	const char *_graphBaseUrl = "https://graph.microsoft.com";
+	const char *_rootCACertificate = NULL;
 
 	GraphAuthContext _context;
 	GraphError _lastError;
+	GraphResponseCache _cache;
+	GraphClock _clock = millis;
+
+	std::vector<GraphPendingWrite> _pendingWrites;
+	bool _persistWrites = false;
+	int _lastHttpCode = 0;
+	char _errorCode[64];
+
+	// The HTTPClients are declared last, ~HTTPClient() stops the WiFiClientSecure it uses
+	bool _keepAlive = false;
+	WiFiClientSecure _secureGraph;
+	WiFiClientSecure _secureLogin;
+	HTTPClient _httpGraph;
+	HTTPClient _httpLogin;
 
 	void _handleApiError(JsonDocument &errorDoc, GraphError &errorObject);
+	static time_t _parseDateTime(const char *dateTime, const char *timeZone);
+	unsigned long _now();
+	uint32_t _newUserKey();
+	char *_readBody(HTTPClient &https, size_t &length);
+	void _setToken(char *&token, const char *value);
+	bool _isGraphUrl(const char *url);
+	bool _beginRequest(HTTPClient &https, const char *url);
+	HTTPClient &_httpClientFor(const char *url, HTTPClient &localHttps);
+	bool _queueWrite(const char *url, const char *payload, uint32_t userKey);
+	uint32_t _resourceKey(const char *url, bool parent);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef ArduinoMSGraphAllocator_h
+#define ArduinoMSGraphAllocator_h
+
+// Define MSGRAPH_USE_PSRAM (e.g. build_flags = -DMSGRAPH_USE_PSRAM) to place large JSON documents
+// and response buffers in PSRAM. Without it, or if no PSRAM is found, the internal heap is used.
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifdef MSGRAPH_USE_PSRAM
+#include <esp_heap_caps.h>
+#endif
+
+// Allocator for large, short-lived buffers. Small objects stay on the internal heap.
+struct GraphAllocator {
+	void *allocate(size_t size) {
+		#ifdef MSGRAPH_USE_PSRAM
+			if (psramFound()) {
+				void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+				if (ptr != NULL) {
+					return ptr;
+				}
+			}
+		#endif
+		return malloc(size);
+	}
+
+	void deallocate(void *ptr) {
+		// free() releases memory from any heap_caps region
+		free(ptr);
+	}
+
+	void *reallocate(void *ptr, size_t size) {
+		#ifdef MSGRAPH_USE_PSRAM
+			if (psramFound()) {
+				void *newPtr = heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+				if (newPtr != NULL) {
+					return newPtr;
+				}
+			}
+		#endif
+		return realloc(ptr, size);
+	}
+};
+
+typedef BasicJsonDocument<GraphAllocator> GraphJsonDocument;
+
+#endif
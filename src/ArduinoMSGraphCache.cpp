@@ -0,0 +1,361 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "ArduinoMSGraph.h"
+#include "ArduinoMSGraphCache.h"
+
+/**
+ * Create a new, empty response cache
+ */
+GraphResponseCache::GraphResponseCache() {
+}
+
+
+/**
+ * Release all cached documents
+ */
+GraphResponseCache::~GraphResponseCache() {
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		_releaseEntry(_entries[i]);
+	}
+}
+
+
+/**
+ * Find a cached response. Falls back to flash if the entry is not in RAM and flash spill is enabled.
+ *
+ * @param key Cache key, see GraphResponseCache::hash()
+ * @param resource Resource hash, assigned to entries restored from flash
+ * @param now Current timestamp in ms
+ *
+ * @returns Pointer to the entry or NULL if nothing is cached for this key.
+ */
+GraphCacheEntry *GraphResponseCache::find(uint32_t key, uint32_t resource, unsigned long now) {
+	if (!_enabled) {
+		return NULL;
+	}
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		if (_entries[i].doc != NULL && _entries[i].key == key) {
+			_entries[i].lastUsed = now;
+			return &_entries[i];
+		}
+	}
+
+	if (_flashSpill) {
+		return _restoreEntry(key, resource, now);
+	}
+	return NULL;
+}
+
+
+/**
+ * Check if an entry may be served without asking the server (TTL mode).
+ *
+ * @param entry Entry returned by find()
+ * @param now Current timestamp in ms
+ *
+ * @returns True if the entry is younger than the configured TTL.
+ */
+bool GraphResponseCache::isFresh(GraphCacheEntry *entry, unsigned long now) {
+	if (entry == NULL || entry->stale || _ttl == 0) {
+		return false;
+	}
+	return (now - entry->storedAt) < _ttl;
+}
+
+
+/**
+ * Mark an entry as confirmed by the server (HTTP 304).
+ *
+ * @param entry Entry returned by find()
+ * @param now Current timestamp in ms
+ */
+void GraphResponseCache::revalidate(GraphCacheEntry *entry, unsigned long now) {
+	entry->storedAt = now;
+	entry->lastUsed = now;
+	entry->stale = false;
+	stats.hits++;
+	stats.revalidated++;
+}
+
+
+/**
+ * Store a parsed response. Responses without ETag are only stored when a TTL is set, nothing is stored while disabled.
+ *
+ * @param key Cache key, see GraphResponseCache::hash()
+ * @param resource Resource hash, see invalidate()
+ * @param etag ETag returned by the server, may be NULL or empty.
+ * @param doc Parsed response, will be copied.
+ * @param now Current timestamp in ms
+ *
+ * @returns True if the response was cached.
+ */
+bool GraphResponseCache::store(uint32_t key, uint32_t resource, const char *etag, JsonDocument &doc, unsigned long now) {
+	bool hasEtag = (etag != NULL && strlen(etag) > 0);
+	if (!_enabled || (!hasEtag && _ttl == 0)) {
+		return false;
+	}
+	if (doc.memoryUsage() > MSGRAPH_CACHE_MAX_SIZE) {
+		#ifdef MSGRAPH_DEBUG
+			Serial.printf("GraphResponseCache::store() - Document too large: %d\n", doc.memoryUsage());
+		#endif
+		return false;
+	}
+
+	GraphCacheEntry *entry = NULL;
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		if (_entries[i].doc != NULL && _entries[i].key == key) {
+			entry = &_entries[i];
+			break;
+		}
+	}
+	if (entry == NULL) {
+		entry = _allocateEntry(now);
+	}
+	_releaseEntry(*entry);
+
+	// Copying produces the same pool layout, so the source usage plus some slack is enough
+	entry->doc = new GraphJsonDocument(doc.memoryUsage() + 256);
+	if (entry->doc->capacity() == 0) {
+		_releaseEntry(*entry);
+		return false;
+	}
+	if (!entry->doc->set(doc)) {
+		#ifdef MSGRAPH_DEBUG
+			DBG_PRINTLN(F("GraphResponseCache::store() - Copy incomplete, not cached"));
+		#endif
+		_releaseEntry(*entry);
+		return false;
+	}
+	entry->key = key;
+	entry->resource = resource;
+	entry->etag = hasEtag ? strdup(etag) : NULL;
+	entry->storedAt = now;
+	entry->lastUsed = now;
+	entry->stale = false;
+
+	if (_flashSpill && hasEtag) {
+		_spillEntry(*entry);
+	}
+	return true;
+}
+
+
+/**
+ * Drop all entries of a resource from RAM and flash, e.g. after it was changed by a write.
+ *
+ * @param resource Resource hash
+ */
+void GraphResponseCache::invalidate(uint32_t resource) {
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		if (_entries[i].doc != NULL && _entries[i].resource == resource) {
+			char filename[32];
+			sprintf(filename, "%s%08x", CACHE_FILE_PREFIX, _entries[i].key);
+			if (_flashSpill && SPIFFS.exists(filename)) {
+				SPIFFS.remove(filename);
+			}
+			_releaseEntry(_entries[i]);
+		}
+	}
+}
+
+
+/**
+ * Drop all entries from RAM and flash.
+ */
+void GraphResponseCache::clear() {
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		_releaseEntry(_entries[i]);
+	}
+
+	File root = SPIFFS.open("/");
+	if (!root) {
+		return;
+	}
+
+	// Collect names first, removing files while iterating the directory is not safe
+	std::vector<String> filenames;
+	File file = root.openNextFile();
+	while (file) {
+		String name = file.name();
+		file.close();
+		if (name.indexOf(&CACHE_FILE_PREFIX[1]) >= 0) {
+			if (!name.startsWith("/")) {
+				name = "/" + name;
+			}
+			filenames.push_back(name);
+		}
+		file = root.openNextFile();
+	}
+	root.close();
+
+	for (size_t i = 0; i < filenames.size(); i++) {
+		SPIFFS.remove(filenames[i]);
+	}
+}
+
+
+/**
+ * Enable or disable the cache. Disabled (default), nothing is stored and no memory is used.
+ * Disabling releases all entries held in RAM, spilled entries stay in flash.
+ *
+ * @param enabled True to enable the cache
+ */
+void GraphResponseCache::setEnabled(bool enabled) {
+	_enabled = enabled;
+	if (!enabled) {
+		for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+			_releaseEntry(_entries[i]);
+		}
+	}
+}
+
+
+/**
+ * Set the time responses are served from cache without contacting the server.
+ * 0 (default) disables TTL mode, then only responses with ETag are cached and always revalidated.
+ *
+ * @param ttl Time to live in ms
+ */
+void GraphResponseCache::setTTL(unsigned long ttl) {
+	_ttl = ttl;
+}
+
+
+/**
+ * Enable writing responses with ETag to SPIFFS, so they can be revalidated after eviction or reboot.
+ *
+ * @param enabled True to enable flash spill
+ */
+void GraphResponseCache::setFlashSpill(bool enabled) {
+	_flashSpill = enabled;
+}
+
+
+/**
+ * Calculate a FNV-1a hash of a string. Can be chained using the seed parameter.
+ *
+ * @param data String to hash, NULL is ignored.
+ * @param seed Start value or result of a previous call.
+ *
+ * @returns 32 bit hash
+ */
+uint32_t GraphResponseCache::hash(const char *data, uint32_t seed) {
+	uint32_t h = seed;
+	if (data != NULL) {
+		while (*data) {
+			h ^= (uint8_t)*data++;
+			h *= 16777619UL;
+		}
+	}
+	return h;
+}
+
+
+/**
+ * Return a free slot or evict the least recently used entry.
+ * Ages are compared instead of timestamps, so this stays correct when the clock wraps.
+ */
+GraphCacheEntry *GraphResponseCache::_allocateEntry(unsigned long now) {
+	GraphCacheEntry *oldest = &_entries[0];
+	for (int i = 0; i < MSGRAPH_CACHE_ENTRIES; i++) {
+		if (_entries[i].doc == NULL) {
+			return &_entries[i];
+		}
+		if (now - _entries[i].lastUsed > now - oldest->lastUsed) {
+			oldest = &_entries[i];
+		}
+	}
+
+	stats.evictions++;
+	_releaseEntry(*oldest);
+	return oldest;
+}
+
+
+/**
+ * Free memory held by an entry.
+ */
+void GraphResponseCache::_releaseEntry(GraphCacheEntry &entry) {
+	if (entry.doc != NULL) {
+		delete entry.doc;
+		entry.doc = NULL;
+	}
+	if (entry.etag != NULL) {
+		free(entry.etag);
+		entry.etag = NULL;
+	}
+	entry.key = 0;
+	entry.resource = 0;
+}
+
+
+/**
+ * Write an entry to SPIFFS. First line holds the ETag, followed by the JSON document.
+ */
+bool GraphResponseCache::_spillEntry(GraphCacheEntry &entry) {
+	char filename[32];
+	sprintf(filename, "%s%08x", CACHE_FILE_PREFIX, entry.key);
+
+	File file = SPIFFS.open(filename, FILE_WRITE);
+	if (!file) {
+		return false;
+	}
+	file.print(entry.etag);
+	file.print('\n');
+	size_t bytesWritten = serializeJson(*entry.doc, file);
+	file.close();
+
+	return bytesWritten > 0;
+}
+
+
+/**
+ * Read an entry from SPIFFS into RAM. Restored entries are stale and need revalidation.
+ */
+GraphCacheEntry *GraphResponseCache::_restoreEntry(uint32_t key, uint32_t resource, unsigned long now) {
+	char filename[32];
+	sprintf(filename, "%s%08x", CACHE_FILE_PREFIX, key);
+
+	if (!SPIFFS.exists(filename)) {
+		return NULL;
+	}
+	File file = SPIFFS.open(filename);
+	if (!file) {
+		return NULL;
+	}
+
+	String etag = file.readStringUntil('\n');
+	GraphJsonDocument *doc = new GraphJsonDocument(MSGRAPH_CACHE_MAX_SIZE);
+	DeserializationError err = deserializeJson(*doc, file);
+	file.close();
+
+	if (err || etag.length() == 0) {
+		#ifdef MSGRAPH_DEBUG
+			DBG_PRINT(F("GraphResponseCache::_restoreEntry() - Invalid file: "));
+			DBG_PRINTLN(filename);
+		#endif
+		delete doc;
+		SPIFFS.remove(filename);
+		return NULL;
+	}
+	doc->shrinkToFit();
+
+	GraphCacheEntry *entry = _allocateEntry(now);
+	entry->doc = doc;
+	entry->key = key;
+	entry->resource = resource;
+	entry->etag = strdup(etag.c_str());
+	entry->storedAt = now;
+	entry->lastUsed = now;
+	entry->stale = true;
+	return entry;
+}
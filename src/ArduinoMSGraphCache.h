@@ -0,0 +1,85 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef ArduinoMSGraphCache_h
+#define ArduinoMSGraphCache_h
+
+#ifndef MSGRAPH_CACHE_ENTRIES
+#define MSGRAPH_CACHE_ENTRIES 4						// Number of responses kept in RAM
+#endif
+
+#ifndef MSGRAPH_CACHE_MAX_SIZE
+#define MSGRAPH_CACHE_MAX_SIZE 12000				// Max. memory usage of a single cached JsonDocument
+#endif
+
+#define CACHE_FILE_PREFIX "/graph_cache_"			// Filename prefix for cache entries spilled to flash
+
+#include <Arduino.h>
+#include <vector>
+#include <ArduinoJson.h>
+#include "SPIFFS.h"
+#include "ArduinoMSGraphAllocator.h"
+
+typedef struct {
+	unsigned long hits = 0;			// Served from cache, including 304 revalidations
+	unsigned long misses = 0;		// Full response downloaded and parsed
+	unsigned long revalidated = 0;	// Answered by the server with 304 Not Modified
+	unsigned long evictions = 0;	// Entries dropped from RAM to make room
+} GraphCacheStats;
+
+typedef struct {
+	uint32_t key = 0;
+	uint32_t resource = 0;			// Hash of the URL without query, see invalidate()
+	char *etag = NULL;
+	unsigned long storedAt = 0;
+	unsigned long lastUsed = 0;
+	bool stale = false;				// Restored from flash, always needs revalidation
+	GraphJsonDocument *doc = NULL;
+} GraphCacheEntry;
+
+
+class GraphResponseCache {
+public:
+	GraphCacheStats stats;
+
+	// Constructor
+	GraphResponseCache();
+	~GraphResponseCache();
+
+	// Lookup & Storage
+	GraphCacheEntry *find(uint32_t key, uint32_t resource, unsigned long now);
+	bool isFresh(GraphCacheEntry *entry, unsigned long now);
+	void revalidate(GraphCacheEntry *entry, unsigned long now);
+	bool store(uint32_t key, uint32_t resource, const char *etag, JsonDocument &doc, unsigned long now);
+	void invalidate(uint32_t resource);
+	void clear();
+
+	// Settings
+	void setEnabled(bool enabled);
+	void setTTL(unsigned long ttl);
+	void setFlashSpill(bool enabled);
+
+	// Helper
+	static uint32_t hash(const char *data, uint32_t seed = 2166136261UL);
+
+private:
+	GraphCacheEntry _entries[MSGRAPH_CACHE_ENTRIES];
+	bool _enabled = false;
+	unsigned long _ttl = 0;
+	bool _flashSpill = false;
+
+	GraphCacheEntry *_allocateEntry(unsigned long now);
+	void _releaseEntry(GraphCacheEntry &entry);
+	bool _spillEntry(GraphCacheEntry &entry);
+	GraphCacheEntry *_restoreEntry(uint32_t key, uint32_t resource, unsigned long now);
+};
+
+#endif
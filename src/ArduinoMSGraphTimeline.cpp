@@ -0,0 +1,157 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include <algorithm>
+#include "ArduinoMSGraphTimeline.h"
+
+/**
+ * Build the timeline from the result of getUserEvents(). Events without valid times are skipped.
+ * 
+ * @param events Events with parsed startDate.epoch and endDate.epoch
+ */
+void GraphTimeline::build(const std::vector<GraphEvent> &events) {
+	_entries.clear();
+	_maxEnd.clear();
+	_blocks.clear();
+
+	for (size_t i = 0; i < events.size(); i++) {
+		if (events[i].startDate.epoch == 0 || events[i].endDate.epoch < events[i].startDate.epoch) {
+			continue;
+		}
+		GraphTimelineEntry entry = { events[i].startDate.epoch, events[i].endDate.epoch, (int)i };
+		_entries.push_back(entry);
+	}
+
+	std::sort(_entries.begin(), _entries.end(), [](const GraphTimelineEntry &a, const GraphTimelineEntry &b) {
+		return a.start < b.start;
+	});
+
+	for (size_t i = 0; i < _entries.size(); i++) {
+		time_t maxEnd = (i > 0 && _maxEnd[i - 1] > _entries[i].end) ? _maxEnd[i - 1] : _entries[i].end;
+		_maxEnd.push_back(maxEnd);
+
+		if (!_blocks.empty() && _entries[i].start <= _blocks.back().end) {
+			if (_entries[i].end > _blocks.back().end) {
+				_blocks.back().end = _entries[i].end;
+			}
+		} else {
+			GraphBusyBlock block = { _entries[i].start, _entries[i].end };
+			_blocks.push_back(block);
+		}
+	}
+}
+
+
+/**
+ * Return number of events in the timeline
+ * 
+ * @returns Number of events
+ */
+size_t GraphTimeline::size() {
+	return _entries.size();
+}
+
+
+/**
+ * Get the event running at the given time. With overlapping events, the one started last wins.
+ * 
+ * @param now Unix time
+ * 
+ * @returns Index in the events vector or -1 if there is no running event.
+ */
+int GraphTimeline::getCurrentEvent(time_t now) {
+	auto it = std::upper_bound(_entries.begin(), _entries.end(), now, [](time_t t, const GraphTimelineEntry &e) {
+		return t < e.start;
+	});
+
+	// Walk back only while an earlier event may still be running
+	for (int i = (int)(it - _entries.begin()) - 1; i >= 0 && _maxEnd[i] > now; i--) {
+		if (_entries[i].end > now) {
+			return _entries[i].index;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Get the next event starting after the given time.
+ * 
+ * @param now Unix time
+ * 
+ * @returns Index in the events vector or -1 if there is no upcoming event.
+ */
+int GraphTimeline::getNextEvent(time_t now) {
+	auto it = std::upper_bound(_entries.begin(), _entries.end(), now, [](time_t t, const GraphTimelineEntry &e) {
+		return t < e.start;
+	});
+	return (it == _entries.end()) ? -1 : it->index;
+}
+
+
+/**
+ * Check if any event is running at the given time.
+ * 
+ * @param now Unix time
+ * 
+ * @returns True if busy
+ */
+bool GraphTimeline::isBusy(time_t now) {
+	return _findBlock(now) >= 0;
+}
+
+
+/**
+ * Get the end of the current busy time, back-to-back and overlapping events are merged.
+ * 
+ * @param now Unix time
+ * 
+ * @returns Unix time when busy time ends, now if currently free.
+ */
+time_t GraphTimeline::getBusyUntil(time_t now) {
+	int block = _findBlock(now);
+	return (block >= 0) ? _blocks[block].end : now;
+}
+
+
+/**
+ * Get the start of the next busy time.
+ * 
+ * @param now Unix time
+ * 
+ * @returns Unix time when free time ends, now if currently busy, 0 if no further events.
+ */
+time_t GraphTimeline::getFreeUntil(time_t now) {
+	if (_findBlock(now) >= 0) {
+		return now;
+	}
+	auto it = std::upper_bound(_blocks.begin(), _blocks.end(), now, [](time_t t, const GraphBusyBlock &b) {
+		return t < b.start;
+	});
+	return (it == _blocks.end()) ? 0 : it->start;
+}
+
+
+/**
+ * Find the busy block containing the given time.
+ * 
+ * @returns Index in _blocks or -1
+ */
+int GraphTimeline::_findBlock(time_t now) {
+	auto it = std::upper_bound(_blocks.begin(), _blocks.end(), now, [](time_t t, const GraphBusyBlock &b) {
+		return t < b.start;
+	});
+	if (it == _blocks.begin()) {
+		return -1;
+	}
+	--it;
+	return (now < it->end) ? (int)(it - _blocks.begin()) : -1;
+}
@@ -0,0 +1,50 @@
+/*
+	Copyright (c) 2020 Tobias Blum. All rights reserved.
+
+	ArduinoMSGraph - A library to wrap the Microsoft Graph API (supports ESP32 & possibly others)
+	https://github.com/toblum/ArduinoMSGraph
+
+	This Source Code Form is subject to the terms of the Mozilla Public
+	License, v. 2.0. If a copy of the MPL was not distributed with this
+	file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef ArduinoMSGraphTimeline_h
+#define ArduinoMSGraphTimeline_h
+
+#include "ArduinoMSGraph.h"
+
+typedef struct {
+	time_t start;
+	time_t end;
+	int index;			// Index in the events vector passed to build()
+} GraphTimelineEntry;
+
+typedef struct {
+	time_t start;
+	time_t end;
+} GraphBusyBlock;
+
+
+class GraphTimeline {
+public:
+	// Setup
+	void build(const std::vector<GraphEvent> &events);
+	size_t size();
+
+	// Queries, O(log n). getCurrentEvent() additionally walks back over k overlapping events
+	int getCurrentEvent(time_t now);
+	int getNextEvent(time_t now);
+	bool isBusy(time_t now);
+	time_t getBusyUntil(time_t now);
+	time_t getFreeUntil(time_t now);
+
+private:
+	std::vector<GraphTimelineEntry> _entries;	// Sorted by start
+	std::vector<time_t> _maxEnd;				// Latest end of _entries[0..i]
+	std::vector<GraphBusyBlock> _blocks;		// Merged, non overlapping busy times
+
+	int _findBlock(time_t now);
+};
+
+#endif